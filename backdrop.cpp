@@ -0,0 +1,1038 @@
+/*
+ * Copyright (C) 2021 Microchip Technology Inc.  All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <algorithm>
+#include <atomic>
+#include <cairo/cairo.h>
+#include <cmath>
+#include <condition_variable>
+#include <egt/timer.h>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include "backdrop.h"
+#include "blur.h"
+
+namespace egt
+{
+inline namespace v1
+{
+
+/*
+ * FNV-1a over whole pixels. Much cheaper than the blur and good enough to
+ * tell whether a new capture matches the one the backdrop was made from.
+ */
+static uint32_t hash_pixels(const uint8_t* data, int width, int height, int stride)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < height; i++)
+    {
+        auto s = reinterpret_cast<const uint32_t*>(data + i * stride);
+        for (int j = 0; j < width; j++)
+        {
+            hash ^= s[j];
+            hash *= 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+/*
+ * Changed tiles as rectangles on screen. Adjacent tiles in a tile row are
+ * merged, and since upscaling blends each pixel with its neighbours a
+ * reduced scale capture grows them by one captured pixel.
+ */
+static std::vector<Rect> changed_regions(const BlurTiles& tiles, int width, int height,
+                                         int scale, const Size& screen)
+{
+    const int size = BlurTiles::SIZE;
+    const int grow = scale > 1 ? 1 : 0;
+    std::vector<Rect> changed;
+
+    for (int ty = 0; ty < tiles.rows; ty++)
+    {
+        const int y = ty * size;
+        const int h = std::min(y + size, height) - y;
+        int start = -1;
+
+        for (int tx = 0; tx <= tiles.columns; tx++)
+        {
+            if (tx < tiles.columns && tiles.changed[ty * tiles.columns + tx])
+            {
+                if (start < 0)
+                    start = tx;
+            }
+            else if (start >= 0)
+            {
+                const int x = start * size;
+                const int w = std::min(tx * size, width) - x;
+                const Rect grown((x - grow) * scale, (y - grow) * scale,
+                                 (w + 2 * grow) * scale, (h + 2 * grow) * scale);
+                const auto clipped = Rect::intersection(grown, Rect(Point(), screen));
+                if (!clipped.empty())
+                    changed.push_back(clipped);
+                start = -1;
+            }
+        }
+    }
+
+    return changed;
+}
+
+/*
+ * Blur config for a reduced scale capture, shrunk with the image so the
+ * blur looks the same size on screen. The kernel narrows first. A box
+ * filter then drops passes to match the variance of the original, since
+ * its kernel cannot get narrower than 3. One 3 wide pass is as small as it
+ * gets, so a box blur that is already that small comes out wider on screen.
+ */
+static BlurConfig scaled_config(const BlurConfig& config, int scale)
+{
+    auto result = config;
+    result.kernel = std::max(config.kernel / scale | 1, 3);
+
+    if (config.algorithm == BlurAlgorithm::box)
+    {
+        // each pass of a k wide box adds (k * k - 1) / 12 to the variance
+        const double target = config.iterations * (config.kernel * config.kernel - 1) / 12.0 /
+                              (scale * scale);
+        const double pass = (result.kernel * result.kernel - 1) / 12.0;
+        result.iterations = std::max(static_cast<int>(std::lround(target / pass)), 1);
+    }
+
+    return result;
+}
+
+static shared_cairo_surface_t create_surface(const Size& screen, int scale)
+{
+    return shared_cairo_surface_t(
+               cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                          (screen.width() + scale - 1) / scale,
+                                          (screen.height() + scale - 1) / scale),
+               cairo_surface_destroy);
+}
+
+/*
+ * Render the screen to a surface created by create_surface(). At reduced
+ * scale the windows rasterize straight into the smaller surface.
+ */
+static void paint_windows(Application& app, const shared_cairo_surface_t& surface, int scale,
+                          bool top_level, bool planes)
+{
+    auto cr = shared_cairo_t(cairo_create(surface.get()), cairo_destroy);
+    cairo_scale(cr.get(), 1.0 / scale, 1.0 / scale);
+
+    Painter painter(cr);
+    for (auto& w : app.windows())
+    {
+        if (!w->visible())
+            continue;
+
+        // draw top level frames and plane frames
+        if ((top_level && w->top_level()) || (planes && w->plane_window()))
+            w->paint(painter);
+    }
+}
+
+/*
+ * State of a running stream(). The GUI thread captures into pending and
+ * shows ready, the blur thread turns pending into ready. Each slot holds
+ * one frame, a newer frame replaces an older one that has not been picked
+ * up yet, so a slow blur drops frames rather than falling behind.
+ */
+struct Backdrop::Stream
+{
+    Stream(std::shared_ptr<Source> source, std::chrono::milliseconds period)
+        : source(std::move(source)), timer(period)
+    {}
+
+    /// A captured or blurred screen.
+    struct Frame
+    {
+        shared_cairo_surface_t surface;
+        std::vector<Rect> changed;
+    };
+
+    std::shared_ptr<Source> source;
+    PeriodicTimer timer;
+    std::thread worker;
+
+    /// Screen captured without the source, at the start of the stream.
+    shared_cairo_surface_t screen;
+    /// Blur engine, scaled for the capture.
+    BlurConfig config;
+    int scale{1};
+    Size size;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool quit{false};
+    Frame pending;
+    Frame ready;
+    std::vector<shared_cairo_surface_t> spare;
+
+    unsigned shown{0};
+    unsigned dropped{0};
+};
+
+/// A blur engine and capture scale that capture() can fall back to.
+struct BlurLevel
+{
+    int scale;
+    BlurConfig config;
+};
+
+/*
+ * Quality levels for budget(), best first. Fewer box passes or a narrower
+ * Gaussian come first since they lose the least, then a lower capture
+ * scale. The configs are not yet scaled for the capture.
+ */
+static std::vector<BlurLevel> blur_levels(const BlurConfig& config, int scale)
+{
+    std::vector<BlurLevel> levels{{scale, config}};
+
+    while (true)
+    {
+        auto level = levels.back();
+        if (level.config.algorithm == BlurAlgorithm::box && level.config.iterations > 1)
+            level.config.iterations--;
+        else if (level.config.algorithm == BlurAlgorithm::gaussian && level.config.kernel > 5)
+            level.config.kernel = level.config.kernel / 2 | 1;
+        else if (level.scale < 4)
+            level.scale = std::min(level.scale * 2, 4);
+        else
+            break;
+
+        levels.push_back(level);
+    }
+
+    return levels;
+}
+
+/*
+ * Cost model behind budget(). Costs are in microseconds per pixel and
+ * learned from the captures themselves, each new measurement counting for
+ * half. Until the first capture the blur costs come from a small
+ * calibration, and the first capture times a quarter scale repaint.
+ */
+struct Backdrop::Governor
+{
+    using duration = std::chrono::duration<double, std::micro>;
+
+    Governor(std::chrono::microseconds budget, std::chrono::milliseconds period)
+        : budget(budget), period(period), refine(period)
+    {
+        calibrate();
+    }
+
+    ~Governor()
+    {
+        discard();
+    }
+
+    /// Drop the refinement step in progress, waiting for its blur thread.
+    void discard()
+    {
+        if (step && step->worker.joinable())
+            step->worker.join();
+        step.reset();
+    }
+
+    /// Passes over each pixel, the Gaussian reads a row or column per tap.
+    static double passes(const BlurConfig& config)
+    {
+        return config.algorithm == BlurAlgorithm::gaussian ? 2 * config.kernel : 2 * config.iterations;
+    }
+
+    static double pixels(const Size& screen, int scale)
+    {
+        return static_cast<double>((screen.width() + scale - 1) / scale) *
+               ((screen.height() + scale - 1) / scale);
+    }
+
+    static double average(double cost, double sample)
+    {
+        return cost > 0 ? (cost + sample) / 2 : sample;
+    }
+
+    double predict_repaint(const Size& screen, int scale) const
+    {
+        return repaint_cost * pixels(screen, scale);
+    }
+
+    double predict_blur(const Size& screen, int scale, const BlurConfig& config, double share) const
+    {
+        return blur_cost[static_cast<int>(config.algorithm)] *
+               pixels(screen, scale) * share * passes(config);
+    }
+
+    void learn(const Size& screen, int scale, const BlurConfig& config, double share,
+               duration repaint, duration blurred)
+    {
+        const auto count = pixels(screen, scale);
+        repaint_cost = average(repaint_cost, repaint.count() / count);
+        if (share > 0)
+        {
+            auto& cost = blur_cost[static_cast<int>(config.algorithm)];
+            cost = average(cost, blurred.count() / (count * share * passes(config)));
+        }
+        changed = share;
+    }
+
+    /// Time both filters on a small noise image.
+    void calibrate()
+    {
+        const int size = 128;
+        std::vector<uint32_t> image(size * size);
+        uint32_t seed = 1;
+        for (auto& p : image)
+        {
+            seed = seed * 1103515245u + 12345u;
+            p = seed;
+        }
+
+        for (auto algorithm : {BlurAlgorithm::gaussian, BlurAlgorithm::box})
+        {
+            BlurConfig config;
+            config.algorithm = algorithm;
+            config.kernel = 9;
+            config.iterations = 1;
+
+            const auto start = std::chrono::steady_clock::now();
+            blur(config, reinterpret_cast<uint8_t*>(image.data()), size, size, size * 4);
+            const duration elapsed = std::chrono::steady_clock::now() - start;
+
+            blur_cost[static_cast<int>(algorithm)] = elapsed.count() / (size * size * passes(config));
+        }
+    }
+
+    /// A refinement step, blurred on a worker thread.
+    struct Step
+    {
+        shared_cairo_surface_t surface;
+        Size screen;
+        BlurConfig config;
+        int scale{1};
+        size_t level{0};
+        uint32_t hash{0};
+        std::vector<Rect> changed;
+        std::atomic<bool> done{false};
+        std::thread worker;
+    };
+
+    /// Time allowed for a capture.
+    std::chrono::microseconds budget;
+    /// Time between refinement steps.
+    std::chrono::milliseconds period;
+    /// Calls refine() every frame while the backdrop is degraded.
+    PeriodicTimer refine;
+    /// Refinement step in progress, if any.
+    std::unique_ptr<Step> step;
+    /// Application given to the last capture().
+    Application* app{nullptr};
+
+    /// Repaint cost per captured pixel.
+    double repaint_cost{0};
+    /// Blur cost per changed pixel and pass, indexed by BlurAlgorithm.
+    double blur_cost[2]{0, 0};
+    /// Share of the tiles the last capture changed.
+    double changed{1};
+};
+
+void Backdrop::PlaneSource::paint(Painter& painter)
+{
+    for (auto& w : m_app.windows())
+    {
+        if (w->visible() && w->plane_window())
+            w->paint(painter);
+    }
+}
+
+void Backdrop::PatternSource::paint(Painter& painter)
+{
+    auto cr = painter.context().get();
+    m_frame++;
+
+    // scrolling color bars with a bouncing ball, enough movement and
+    // texture to keep the blur busy
+    cairo_save(cr);
+    cairo_rectangle(cr, m_rect.x(), m_rect.y(), m_rect.width(), m_rect.height());
+    cairo_clip(cr);
+
+    const int bar = 40;
+    for (int x = -bar; x < m_rect.width() + bar; x += bar)
+    {
+        const int n = (x + m_frame * 4) / bar;
+        cairo_set_source_rgb(cr, (n % 3) / 2.0, (n % 5) / 4.0, (n % 7) / 6.0);
+        cairo_rectangle(cr, m_rect.x() + x - (m_frame * 4) % bar, m_rect.y(), bar, m_rect.height());
+        cairo_fill(cr);
+    }
+
+    const int radius = std::min(m_rect.width(), m_rect.height()) / 6;
+    const int range_x = std::max(m_rect.width() - 2 * radius, 1);
+    const int range_y = std::max(m_rect.height() - 2 * radius, 1);
+    const int px = (m_frame * 7) % (2 * range_x);
+    const int py = (m_frame * 5) % (2 * range_y);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_arc(cr,
+              m_rect.x() + radius + (px < range_x ? px : 2 * range_x - px),
+              m_rect.y() + radius + (py < range_y ? py : 2 * range_y - py),
+              radius, 0, 2 * M_PI);
+    cairo_fill(cr);
+    cairo_restore(cr);
+}
+
+Backdrop::Backdrop(const BlurConfig& config)
+    : m_config(config)
+{
+}
+
+Backdrop::~Backdrop()
+{
+    stop_stream();
+}
+
+void Backdrop::config(const BlurConfig& config)
+{
+    m_config = config;
+    m_hash_valid = false;
+    invalidate();
+}
+
+void Backdrop::scale(int scale)
+{
+    m_scale = std::max(scale, 1);
+    m_hash_valid = false;
+    invalidate();
+}
+
+void Backdrop::budget(std::chrono::microseconds budget, std::chrono::milliseconds refine_period)
+{
+    m_governor.reset();
+
+    if (budget.count() > 0)
+    {
+        m_governor = std::make_unique<Governor>(budget, refine_period);
+        m_governor->refine.on_timeout([this]() { refine(); });
+    }
+
+    // a backdrop degraded under the old budget is not reused
+    if (m_level)
+    {
+        m_hash_valid = false;
+        invalidate();
+    }
+}
+
+bool Backdrop::capture(Application& app)
+{
+    // a running stream would replace the capture with its next frame
+    stop_stream();
+
+    if (m_governor)
+    {
+        m_governor->app = &app;
+        m_governor->refine.stop();
+        m_governor->discard();
+    }
+
+    // nothing under the backdrop has changed since it was captured
+    if (m_surface && m_generation == m_captured_generation)
+    {
+        std::cout << "Backdrop reused, no repaint" << std::endl;
+        if (m_level)
+            m_governor->refine.start();
+        return false;
+    }
+
+    const Size screen = app.screen()->size();
+    const auto levels = m_governor ? blur_levels(m_config, m_scale) :
+                        std::vector<BlurLevel> {{m_scale, m_config}};
+    const auto last = levels.size() - 1;
+    double budget = m_governor ? m_governor->budget.count() : 0;
+
+    // the first capture has no repaint cost to go on, a quarter scale
+    // repaint gives one and leaves most of the budget. Per pixel it
+    // overestimates a larger repaint, which errs on the safe side.
+    if (m_governor && m_governor->repaint_cost <= 0)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        auto probe = create_surface(screen, 4);
+        paint_screen(app, probe, 4, true);
+        cairo_surface_flush(probe.get());
+        const Governor::duration elapsed = std::chrono::steady_clock::now() - start;
+
+        m_governor->repaint_cost = elapsed.count() / Governor::pixels(screen, 4);
+        budget -= elapsed.count();
+        std::cout << "Repaint calibration (1/4 scale): " << static_cast<int>(elapsed.count())
+                  << "us" << std::endl;
+    }
+
+    // the best level predicted to fit, its scale is fixed by the repaint
+    size_t level = 0;
+    if (m_governor)
+    {
+        while (level < last &&
+               m_governor->predict_repaint(screen, levels[level].scale) +
+               m_governor->predict_blur(screen, levels[level].scale,
+                                        scaled_config(levels[level].config, levels[level].scale),
+                                        m_governor->changed) > budget)
+            level++;
+    }
+    const int scale = levels[level].scale;
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto surface = create_surface(screen, scale);
+    paint_screen(app, surface, scale, true);
+    cairo_surface_flush(surface.get());
+
+    const Governor::duration repaint = std::chrono::steady_clock::now() - start;
+    std::cout << "Repaint screen to surface (1/" << scale << " scale): "
+              << static_cast<int>(repaint.count()) << "us" << std::endl;
+
+    auto data = cairo_image_surface_get_data(surface.get());
+    const int width = cairo_image_surface_get_width(surface.get());
+    const int height = cairo_image_surface_get_height(surface.get());
+    const int stride = cairo_image_surface_get_stride(surface.get());
+
+    m_captured_generation = m_generation;
+
+    // the screen repainted to the same pixels, keep the blurred copy
+    const uint32_t hash = hash_pixels(data, width, height, stride);
+    if (m_surface && m_hash_valid && hash == m_hash &&
+        scale == m_surface_scale)
+    {
+        std::cout << "Backdrop reused, no blur" << std::endl;
+        if (m_level)
+            m_governor->refine.start();
+        return false;
+    }
+
+    // flat tiles are skipped by the blur and left out of the damage, tiles
+    // found for this level hold for the narrower blurs below it as well
+    const auto tiles = blur_tiles(data, width, height, stride,
+                                  scaled_config(levels[level].config, scale).radius());
+    const auto count = std::count(tiles.changed.begin(), tiles.changed.end(), true);
+    const double share = tiles.changed.empty() ? 0 : static_cast<double>(count) / tiles.changed.size();
+
+    // with the repaint measured, what is left of the budget may call for a
+    // cheaper blur at the same scale
+    if (m_governor)
+    {
+        while (level < last && levels[level + 1].scale == scale &&
+               repaint.count() + m_governor->predict_blur(screen, scale,
+                       scaled_config(levels[level].config, scale), share) > budget)
+            level++;
+    }
+
+    const auto config = scaled_config(levels[level].config, scale);
+    auto changed = changed_regions(tiles, width, height, scale, screen);
+
+    start = std::chrono::steady_clock::now();
+
+    blur(config, data, width, height, stride, &tiles);
+
+    // tell Cairo we changed the image
+    cairo_surface_mark_dirty(surface.get());
+
+    const Governor::duration blurred = std::chrono::steady_clock::now() - start;
+    std::cout << "Blur (" << config << "): " << static_cast<int>(blurred.count()) << "us, "
+              << count << " of " << tiles.changed.size() << " tiles changed" << std::endl;
+
+    if (m_governor)
+    {
+        m_governor->learn(screen, scale, config, share, repaint, blurred);
+        std::cout << "Blur level " << level << " of " << levels.size() - 1
+                  << " (" << config << ", 1/" << scale << " scale): "
+                  << static_cast<int>((repaint + blurred).count()) << "us, budget "
+                  << m_governor->budget.count() << "us" << std::endl;
+    }
+
+    // repaint what the old backdrop covered as well as the new one
+    if (visible())
+        damage();
+
+    m_surface = surface;
+    m_hash = hash;
+    m_hash_valid = true;
+    m_surface_config = config;
+    m_surface_scale = scale;
+    m_level = level;
+    m_changed = std::move(changed);
+    resize(screen);
+
+    if (visible())
+        damage();
+
+    if (m_level)
+    {
+        m_busy = std::chrono::steady_clock::now();
+        m_governor->refine.start();
+    }
+
+    return true;
+}
+
+void Backdrop::paint_screen(Application& app, const shared_cairo_surface_t& surface, int scale,
+                            bool planes)
+{
+    if (!visible() || !parent())
+    {
+        paint_windows(app, surface, scale, true, planes);
+        return;
+    }
+
+    // while shown, paint what lies under the backdrop directly, the parent's
+    // background and the children below it. Nothing above it ends up
+    // blurred under itself and no widget changes state.
+    {
+        auto cr = shared_cairo_t(cairo_create(surface.get()), cairo_destroy);
+        cairo_scale(cr.get(), 1.0 / scale, 1.0 / scale);
+        Painter painter(cr);
+
+        painter.set(parent()->color(Palette::ColorId::bg));
+        painter.draw(parent()->box());
+        painter.fill();
+
+        for (auto& child : parent()->children())
+        {
+            if (child.get() == this)
+                break;
+
+            if (!child->visible() || child->plane_window())
+                continue;
+
+            Painter::AutoSaveRestore sr(painter);
+            const auto& box = child->box();
+            cairo_rectangle(cr.get(), box.x(), box.y(), box.width(), box.height());
+            cairo_clip(cr.get());
+            child->draw(painter, box);
+        }
+    }
+
+    if (planes)
+        paint_windows(app, surface, scale, false, true);
+}
+
+void Backdrop::refine()
+{
+    auto& governor = *m_governor;
+
+    // only the backdrop on screen is refined, a stream replaces it every
+    // frame anyway and a change underneath makes a step stale
+    if (!m_level || !visible() || m_stream || !governor.app ||
+        m_generation != m_captured_generation)
+    {
+        governor.refine.stop();
+        governor.discard();
+        return;
+    }
+
+    if (governor.step)
+    {
+        // still blurring, try again next frame
+        if (!governor.step->done)
+            return;
+
+        governor.step->worker.join();
+        auto step = std::move(governor.step);
+
+        damage();
+        m_surface = step->surface;
+        m_hash = step->hash;
+        m_hash_valid = true;
+        m_surface_config = step->config;
+        m_surface_scale = step->scale;
+        m_level = step->level;
+        m_changed = std::move(step->changed);
+        damage();
+
+        std::cout << "Backdrop refined to level " << m_level << " (" << m_surface_config
+                  << ", 1/" << m_surface_scale << " scale)" << std::endl;
+        return;
+    }
+
+    // start a step only when time allows, once nothing but the backdrop has
+    // been drawn for two periods, for example after the board stops sliding
+    if (std::chrono::steady_clock::now() - m_busy < 2 * governor.period)
+        return;
+
+    const Size screen = governor.app->screen()->size();
+    const auto levels = blur_levels(m_config, m_scale);
+    const auto level = m_level - 1;
+    const int scale = levels[level].scale;
+
+    // the repaint has to run on the GUI thread, so it has to fit the budget
+    if (governor.predict_repaint(screen, scale) > governor.budget.count())
+    {
+        std::cout << "Backdrop refinement stopped at level " << m_level << ", a 1/" << scale
+                  << " scale repaint does not fit the budget" << std::endl;
+        governor.refine.stop();
+        return;
+    }
+
+    auto step = std::make_unique<Governor::Step>();
+    step->surface = create_surface(screen, scale);
+    step->screen = screen;
+    step->config = scaled_config(levels[level].config, scale);
+    // one thread, so the step takes at most one CPU away from the GUI
+    step->config.threads = 1;
+    step->scale = scale;
+    step->level = level;
+
+    const auto start = std::chrono::steady_clock::now();
+    paint_screen(*governor.app, step->surface, scale, true);
+    cairo_surface_flush(step->surface.get());
+    const Governor::duration repaint = std::chrono::steady_clock::now() - start;
+    governor.repaint_cost = Governor::average(governor.repaint_cost,
+                                              repaint.count() / Governor::pixels(screen, scale));
+
+    // the blur runs off the GUI thread, a later frame picks up the result
+    step->worker = std::thread([work = step.get()]()
+    {
+        auto surface = work->surface.get();
+        auto data = cairo_image_surface_get_data(surface);
+        const int width = cairo_image_surface_get_width(surface);
+        const int height = cairo_image_surface_get_height(surface);
+        const int stride = cairo_image_surface_get_stride(surface);
+
+        work->hash = hash_pixels(data, width, height, stride);
+        const auto tiles = blur_tiles(data, width, height, stride, work->config.radius());
+        work->changed = changed_regions(tiles, width, height, work->scale, work->screen);
+        blur(work->config, data, width, height, stride, &tiles);
+        cairo_surface_mark_dirty(surface);
+
+        work->done = true;
+    });
+
+    governor.step = std::move(step);
+}
+
+void Backdrop::stream(Application& app, std::shared_ptr<Source> source,
+                      std::chrono::milliseconds period)
+{
+    stop_stream();
+
+    m_stream = std::make_unique<Stream>(std::move(source), period);
+    auto& stream = *m_stream;
+    stream.config = m_surface_config;
+    stream.scale = m_surface_scale;
+    stream.size = app.screen()->size();
+
+    // everything but the moving content, painted under every frame
+    stream.screen = create_surface(stream.size, stream.scale);
+    paint_screen(app, stream.screen, stream.scale, false);
+
+    stream.worker = std::thread([&stream]()
+    {
+        while (true)
+        {
+            Stream::Frame frame;
+            {
+                std::unique_lock<std::mutex> lock(stream.mutex);
+                stream.condition.wait(lock, [&stream]() { return stream.quit || stream.pending.surface; });
+                if (stream.quit)
+                    return;
+                frame = std::move(stream.pending);
+                stream.pending = {};
+            }
+
+            auto surface = frame.surface.get();
+            auto data = cairo_image_surface_get_data(surface);
+            const int width = cairo_image_surface_get_width(surface);
+            const int height = cairo_image_surface_get_height(surface);
+            const int stride = cairo_image_surface_get_stride(surface);
+
+            const auto tiles = blur_tiles(data, width, height, stride, stream.config.radius());
+            frame.changed = changed_regions(tiles, width, height, stream.scale, stream.size);
+            blur(stream.config, data, width, height, stride, &tiles);
+            cairo_surface_mark_dirty(surface);
+
+            std::lock_guard<std::mutex> lock(stream.mutex);
+            if (stream.ready.surface)
+            {
+                stream.spare.push_back(std::move(stream.ready.surface));
+                stream.dropped++;
+            }
+            stream.ready = std::move(frame);
+        }
+    });
+
+    stream.timer.on_timeout([this]() { next_frame(); });
+    stream.timer.start();
+}
+
+void Backdrop::next_frame()
+{
+    auto& stream = *m_stream;
+    Stream::Frame ready;
+    shared_cairo_surface_t surface;
+
+    {
+        std::lock_guard<std::mutex> lock(stream.mutex);
+        ready = std::move(stream.ready);
+        stream.ready = {};
+
+        if (!stream.spare.empty())
+        {
+            surface = std::move(stream.spare.back());
+            stream.spare.pop_back();
+        }
+    }
+
+    // show frame N-1, repainting what it and the frame before it changed
+    if (ready.surface)
+    {
+        damage();
+        if (m_surface)
+        {
+            std::lock_guard<std::mutex> lock(stream.mutex);
+            stream.spare.push_back(m_surface);
+        }
+        m_surface = std::move(ready.surface);
+        m_changed = std::move(ready.changed);
+        damage();
+        stream.shown++;
+    }
+
+    // capture frame N+1 while the blur thread works on frame N
+    if (!surface)
+        surface = create_surface(stream.size, stream.scale);
+
+    {
+        auto cr = shared_cairo_t(cairo_create(surface.get()), cairo_destroy);
+        cairo_set_source_surface(cr.get(), stream.screen.get(), 0, 0);
+        cairo_set_operator(cr.get(), CAIRO_OPERATOR_SOURCE);
+        cairo_paint(cr.get());
+        cairo_set_operator(cr.get(), CAIRO_OPERATOR_OVER);
+        cairo_scale(cr.get(), 1.0 / stream.scale, 1.0 / stream.scale);
+        Painter painter(cr);
+        stream.source->paint(painter);
+    }
+    cairo_surface_flush(surface.get());
+
+    {
+        std::lock_guard<std::mutex> lock(stream.mutex);
+        if (stream.pending.surface)
+        {
+            stream.spare.push_back(std::move(stream.pending.surface));
+            stream.dropped++;
+        }
+        stream.pending.surface = std::move(surface);
+    }
+    stream.condition.notify_one();
+}
+
+void Backdrop::stop_stream()
+{
+    if (!m_stream)
+        return;
+
+    m_stream->timer.stop();
+    {
+        std::lock_guard<std::mutex> lock(m_stream->mutex);
+        m_stream->quit = true;
+    }
+    m_stream->condition.notify_one();
+    m_stream->worker.join();
+
+    std::cout << "Backdrop stream: " << m_stream->shown << " frames shown, "
+              << m_stream->dropped << " dropped" << std::endl;
+
+    m_stream.reset();
+
+    // the blurred image no longer matches the last capture
+    invalidate();
+    m_hash_valid = false;
+}
+
+bool Backdrop::covers(const Rect& rect) const
+{
+    return visible() && m_surface && Rect::intersection(rect, box()) == rect;
+}
+
+bool Backdrop::absorb(const Rect& rect)
+{
+    if (m_damaging || !parent())
+        return false;
+
+    // anything else drawn while shown means the GUI is busy, refinement
+    // waits for it to settle
+    auto busy = [this]()
+    {
+        if (visible())
+            m_busy = std::chrono::steady_clock::now();
+        return false;
+    };
+
+    if (!covers(rect))
+        return busy();
+
+    // widgets above the backdrop are drawn, including where they were
+    bool above = false;
+    for (auto& child : parent()->children())
+    {
+        if (child.get() == this)
+            above = true;
+        else if (above && child->visible() && !child->plane_window() &&
+                 !Rect::intersection(rect, child->box()).empty())
+            return busy();
+    }
+    for (const auto& box : m_above)
+    {
+        if (!Rect::intersection(rect, box).empty())
+            return busy();
+    }
+
+    // a widget that keeps changing damages the same area again, keep it once
+    for (const auto& covered : m_covered)
+    {
+        if (Rect::intersection(rect, covered) == rect)
+            return true;
+    }
+
+    m_covered.push_back(rect);
+    return true;
+}
+
+void Backdrop::show()
+{
+    m_covered.clear();
+    m_above.clear();
+    Widget::show();
+}
+
+void Backdrop::hide()
+{
+    stop_stream();
+
+    // damage held back under the backdrop is redrawn in the same pass that
+    // removes it
+    for (const auto& rect : m_covered)
+        damage(rect);
+    m_covered.clear();
+
+    Widget::hide();
+}
+
+void Backdrop::damage()
+{
+    if (!m_surface)
+    {
+        Widget::damage();
+        return;
+    }
+
+    for (const auto& rect : m_changed)
+        damage(Rect(point() + rect.point(), rect.size()));
+}
+
+void Backdrop::damage(const Rect& rect)
+{
+    m_damaging = true;
+    Widget::damage(rect);
+    m_damaging = false;
+}
+
+void Backdrop::draw(Painter& painter, const Rect& rect)
+{
+    if (!m_surface)
+        return;
+
+    Painter::AutoSaveRestore sr(painter);
+
+    auto cr = painter.context().get();
+    cairo_rectangle(cr, rect.x(), rect.y(), rect.width(), rect.height());
+    cairo_clip(cr);
+    cairo_rectangle(cr, x(), y(), width(), height());
+    cairo_clip(cr);
+
+    // a reduced scale capture is stretched back over the whole widget
+    cairo_translate(cr, x(), y());
+    cairo_scale(cr, m_surface_scale, m_surface_scale);
+    cairo_set_source_surface(cr, m_surface.get(), 0, 0);
+    if (m_surface_scale > 1)
+    {
+        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_BILINEAR);
+        cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+    }
+    cairo_paint(cr);
+
+    // absorb() checks against where these were drawn
+    m_above.clear();
+    if (parent())
+    {
+        bool above = false;
+        for (auto& child : parent()->children())
+        {
+            if (child.get() == this)
+                above = true;
+            else if (above && child->visible() && !child->plane_window())
+                m_above.push_back(child->box());
+        }
+    }
+}
+
+void BackdropWindow::damage(const Rect& rect)
+{
+    for (auto& child : children())
+    {
+        auto backdrop = dynamic_cast<Backdrop*>(child.get());
+        if (backdrop && backdrop->absorb(rect))
+            return;
+    }
+
+    TopWindow::damage(rect);
+}
+
+void BackdropWindow::draw(Painter& painter, const Rect& rect)
+{
+    auto& children = this->children();
+
+    // the topmost backdrop that hides the whole area, if any
+    for (auto i = children.rbegin(); i != children.rend(); ++i)
+    {
+        auto backdrop = dynamic_cast<Backdrop*>(i->get());
+        if (!backdrop || !backdrop->covers(rect))
+            continue;
+
+        // the blur fades to transparent within its radius of the screen
+        // edge, so the backdrop is not opaque there. Fill the background
+        // first, otherwise the border blends over whatever the last frame
+        // left and changes with every redraw.
+        painter.set(color(Palette::ColorId::bg));
+        painter.draw(rect);
+        painter.fill();
+
+        backdrop->draw(painter, rect);
+
+        for (auto j = i.base(); j != children.end(); ++j)
+        {
+            auto& child = *j;
+            if (!child->visible() || child->plane_window())
+                continue;
+
+            const auto crect = Rect::intersection(rect, child->box());
+            if (crect.empty())
+                continue;
+
+            Painter::AutoSaveRestore sr(painter);
+            auto cr = painter.context().get();
+            cairo_rectangle(cr, crect.x(), crect.y(), crect.width(), crect.height());
+            cairo_clip(cr);
+            child->draw(painter, crect);
+        }
+
+        return;
+    }
+
+    TopWindow::draw(painter, rect);
+}
+
+}
+}
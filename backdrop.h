@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2021 Microchip Technology Inc.  All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef EGT_BACKDROP_H
+#define EGT_BACKDROP_H
+
+/**
+ * @file
+ * @brief Blurred screen backdrop widget.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <egt/app.h>
+#include <egt/painter.h>
+#include <egt/types.h>
+#include <egt/widget.h>
+#include <egt/window.h>
+#include <vector>
+#include "blur.h"
+
+namespace egt
+{
+inline namespace v1
+{
+
+/**
+ * Blurred copy of the screen, placed over the top level widgets while a
+ * SideBoard2 is open.
+ *
+ * The last blurred image is kept between captures. Reopening over a screen
+ * that has not been invalidated reuses it without repainting anything, and
+ * a screen that repaints to the same pixels reuses it without blurring.
+ *
+ * Most of a typical screen is flat color which the blur leaves untouched.
+ * The blur skips those tiles, and damage() only covers the tiles it
+ * actually changed, so showing or hiding the backdrop repaints those tiles
+ * and nothing else.
+ *
+ * While shown the backdrop hides the widgets below it. In a BackdropWindow
+ * their damage is held back rather than drawn, and redrawn when the
+ * backdrop is hidden again. The widgets below keep their visibility and
+ * state.
+ *
+ * Moving content under the backdrop, such as video on a plane window, can
+ * be kept blurred with stream().
+ *
+ * With a budget() the blur quality drops as far as it must for capture()
+ * to finish in time, and the backdrop is refined once there is time again.
+ */
+class EGT_API Backdrop : public Widget
+{
+public:
+
+    /// Moving content painted over the captured screen by stream().
+    class Source
+    {
+    public:
+        /**
+         * Paint the next frame.
+         *
+         * @param[in] painter Painter in screen coordinates.
+         */
+        virtual void paint(Painter& painter) = 0;
+
+        virtual ~Source() = default;
+    };
+
+    /// Paints the plane windows of an application.
+    class PlaneSource : public Source
+    {
+    public:
+        explicit PlaneSource(Application& app)
+            : m_app(app)
+        {}
+
+        void paint(Painter& painter) override;
+
+    protected:
+        Application& m_app;
+    };
+
+    /// Paints a synthetic moving pattern, for trying stream() without video.
+    class PatternSource : public Source
+    {
+    public:
+        /**
+         * @param[in] rect Area of the screen the pattern covers.
+         */
+        explicit PatternSource(const Rect& rect)
+            : m_rect(rect)
+        {}
+
+        void paint(Painter& painter) override;
+
+    protected:
+        Rect m_rect;
+        int m_frame{0};
+    };
+
+    /**
+     * @param[in] config Blur engine applied to the captured screen.
+     */
+    explicit Backdrop(const BlurConfig& config = {});
+
+    ~Backdrop() override;
+
+    /**
+     * Set the blur engine.
+     *
+     * The next capture() repaints and blurs the screen again.
+     */
+    void config(const BlurConfig& config);
+
+    /// Get the blur engine.
+    EGT_NODISCARD const BlurConfig& config() const { return m_config; }
+
+    /**
+     * Capture at a reduced scale.
+     *
+     * With a scale of 2 or 4 the windows are painted straight into a half or
+     * quarter size surface, the blur runs at that size and the result is
+     * stretched back to screen size when drawn. Detail lost this way is lost
+     * to the blur anyway, and both the repaint and the blur get 4 to 16
+     * times cheaper.
+     *
+     * The kernel, and for the box filter the number of passes, shrink with
+     * the scale. A box blur smaller than one 3 wide pass at the reduced
+     * scale comes out wider on screen.
+     *
+     * @param[in] scale Divisor applied to the screen size, 1 for full size.
+     */
+    void scale(int scale);
+
+    /// Get the capture scale.
+    EGT_NODISCARD int scale() const { return m_scale; }
+
+    /**
+     * Keep capture() within a time budget.
+     *
+     * The cost of the repaint and the blur is predicted from recent captures.
+     * Starting from the configured engine and scale, capture() steps down a
+     * ladder of cheaper levels, fewer box passes or a narrower Gaussian and
+     * then a lower capture scale, until the prediction fits. Once the repaint
+     * is done the blur may step down again if it took longer than expected.
+     *
+     * A backdrop captured below full quality is refined while it is shown,
+     * one level at a time, when time allows. In a BackdropWindow a step
+     * only starts once nothing but the backdrop has been damaged for two
+     * refine_period, so not while the board is still sliding. Plane
+     * windows do not damage the window and do not count. Each step repaints
+     * the screen on the GUI thread, but only if that repaint is predicted to
+     * fit the budget, and blurs on a single worker thread. Refinement stops
+     * at the first level whose repaint does not fit.
+     *
+     * @param[in] budget Time allowed for capture(), zero to turn this off.
+     * @param[in] refine_period Time between refinement steps.
+     */
+    void budget(std::chrono::microseconds budget,
+                std::chrono::milliseconds refine_period = std::chrono::milliseconds(33));
+
+    /// Quality level of the backdrop, 0 is the configured engine and scale.
+    EGT_NODISCARD size_t level() const { return m_level; }
+
+    /**
+     * Capture and blur the current screen.
+     *
+     * A visible backdrop captures the widgets it covers, not itself or the
+     * widgets above it. A running stream() is stopped first.
+     *
+     * @param[in] app Application whose windows are captured.
+     * @return true if the backdrop changed, false if the previous one was reused.
+     */
+    bool capture(Application& app);
+
+    /**
+     * Tell the backdrop that something under it has changed.
+     *
+     * The next capture() will repaint the screen instead of reusing the
+     * previous backdrop outright.
+     */
+    void invalidate() { m_generation++; }
+
+    /**
+     * Keep blurring moving content while the backdrop is shown.
+     *
+     * The screen is captured once without the source. Every period the
+     * source paints over a copy of it and the frame goes to a blur thread.
+     * Frame N+1 is captured while frame N is blurred and frame N-1 is
+     * shown. A frame that is still waiting when a newer one arrives is
+     * dropped, so a slow blur lowers the frame rate instead of adding
+     * latency.
+     *
+     * Call this after capture(), frames are blurred at the level capture()
+     * chose. The stream stops when the backdrop is hidden.
+     *
+     * @param[in] app Application whose windows are captured.
+     * @param[in] source Moving content, for example a PlaneSource.
+     * @param[in] period Time between frames.
+     */
+    void stream(Application& app, std::shared_ptr<Source> source,
+                std::chrono::milliseconds period = std::chrono::milliseconds(33));
+
+    /// Stop a stream() and report how many frames were shown and dropped.
+    void stop_stream();
+
+    /**
+     * Whether the backdrop is shown and hides all of rect.
+     *
+     * @param[in] rect Area in parent coordinates.
+     */
+    EGT_NODISCARD bool covers(const Rect& rect) const;
+
+    /**
+     * Hold back damage that only matters to widgets below the backdrop.
+     *
+     * Damage the backdrop hides completely, that does not come from the
+     * backdrop itself and that touches no widget above it, is remembered
+     * instead of drawn, and damaged again by hide(). A widget above counts
+     * where it is and where it was last drawn, so one moving away still
+     * gets its old place redrawn. BackdropWindow calls this for all of its
+     * damage.
+     *
+     * @param[in] rect Damaged area in parent coordinates.
+     * @return true if the damage was held back.
+     */
+    bool absorb(const Rect& rect);
+
+    /// Show the backdrop.
+    void show() override;
+
+    /// Hide the backdrop and redraw what it covered while shown.
+    void hide() override;
+
+    /// Damage only the tiles the blur changed.
+    void damage() override;
+
+    void damage(const Rect& rect) override;
+
+    void draw(Painter& painter, const Rect& rect) override;
+
+protected:
+
+    struct Stream;
+    struct Governor;
+
+    /// Paint the screen as it is under the backdrop.
+    void paint_screen(Application& app, const shared_cairo_surface_t& surface, int scale, bool planes);
+
+    /// Take the next refinement step of a degraded backdrop.
+    void refine();
+
+    /// Show the newest blurred frame and capture the next one.
+    void next_frame();
+
+    /// Blur engine.
+    BlurConfig m_config;
+
+    /// Blur engine used for m_surface, scaled for the capture.
+    BlurConfig m_surface_config;
+
+    /// Blurred screen, captured at 1/m_surface_scale of the widget size.
+    shared_cairo_surface_t m_surface;
+
+    /// Capture scale divisor.
+    int m_scale{1};
+
+    /// Scale divisor of m_surface.
+    int m_surface_scale{1};
+
+    /// Quality level of m_surface.
+    size_t m_level{0};
+
+    /// Areas of m_surface that differ from the screen, relative to the widget.
+    std::vector<Rect> m_changed;
+
+    /// Incremented by invalidate().
+    uint64_t m_generation{0};
+
+    /// m_generation when m_surface was captured.
+    uint64_t m_captured_generation{0};
+
+    /// Hash of the unblurred pixels of m_surface.
+    uint32_t m_hash{0};
+
+    /// m_hash describes m_surface, which is not the case after a stream.
+    bool m_hash_valid{false};
+
+    /// Running stream(), if any.
+    std::unique_ptr<Stream> m_stream;
+
+    /// Cost model behind budget(), if one is set.
+    std::unique_ptr<Governor> m_governor;
+
+    /// Damage held back by absorb() while shown, in parent coordinates.
+    std::vector<Rect> m_covered;
+
+    /// Boxes of the widgets above the backdrop when it was last drawn.
+    std::vector<Rect> m_above;
+
+    /// Set while the backdrop damages itself, its own damage is never held back.
+    bool m_damaging{false};
+
+    /// Last time something other than the backdrop was damaged while shown.
+    std::chrono::steady_clock::time_point m_busy;
+};
+
+/**
+ * Top level window that leaves out the widgets a shown Backdrop covers.
+ *
+ * Damage from widgets under the backdrop is handed to Backdrop::absorb()
+ * and never reaches the window's damage list, so changes underneath cost
+ * no draw or flip until the backdrop is hidden. Other damage inside the
+ * backdrop draws only the backdrop and the children above it.
+ */
+class EGT_API BackdropWindow : public TopWindow
+{
+public:
+
+    using TopWindow::TopWindow;
+
+    using TopWindow::damage;
+
+    void damage(const Rect& rect) override;
+
+    void draw(Painter& painter, const Rect& rect) override;
+};
+
+}
+}
+
+#endif
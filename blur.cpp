@@ -0,0 +1,599 @@
+/*
+ * Copyright (C) 2021 Microchip Technology Inc.  All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "egt/detail/enum.h"
+#include "blur.h"
+
+namespace egt
+{
+inline namespace v1
+{
+
+/*
+ * Both filters are separable and run in place on the ARGB32 image. Instead
+ * of writing the horizontal pass into a second full size surface, each row
+ * is horizontally blurred into a small ring of line buffers just before the
+ * vertical pass needs it. Source row n is only overwritten once the ring
+ * already holds its horizontal result, so the only extra memory is one row
+ * per kernel tap.
+ *
+ * With several threads the rows are split into bands. A band needs the rows
+ * within the kernel radius above and below it, which the neighbouring bands
+ * overwrite, so before any thread starts the rows above are horizontally
+ * blurred into the band's ring and the rows below are copied to its tail.
+ */
+
+namespace
+{
+struct Band
+{
+	/// First row of the band.
+	int first;
+	/// One past the last row of the band.
+	int last;
+	/// Horizontally blurred rows, row n lives in slot n % kernel size.
+	std::vector<uint32_t> ring;
+	/// Unfiltered copy of the rows below the band.
+	std::vector<uint32_t> tail;
+};
+}
+
+template<class Prepare, class Run>
+static void for_each_band(int threads, int width, int height, int stride, int size,
+						  uint8_t* data, Prepare prepare, Run run)
+{
+	const int half = size / 2;
+
+	if (threads <= 0)
+		threads = std::max<int>(std::thread::hardware_concurrency(), 1);
+	threads = std::min(threads, height);
+
+	std::vector<Band> bands(threads);
+	for (int n = 0; n < threads; n++) {
+		auto& band = bands[n];
+		band.first = height * n / threads;
+		band.last = height * (n + 1) / threads;
+		band.ring.resize(size * width);
+
+		const int tail = std::min(band.last + half, height) - band.last;
+		band.tail.resize(tail * width);
+		for (int row = 0; row < tail; row++)
+			std::copy_n((uint32_t *) (data + (band.last + row) * stride), width,
+						band.tail.data() + row * width);
+
+		prepare(band);
+	}
+
+	std::vector<std::thread> workers;
+	for (int n = 1; n < threads; n++)
+		workers.emplace_back([&run, &bands, n]() { run(bands[n]); });
+	run(bands[0]);
+	for (auto& worker : workers)
+		worker.join();
+}
+
+static void gaussian_kernel(int size, std::vector<uint32_t>& kernel, uint32_t& a)
+{
+	// pre-computed 17 tap Gaussian kernel
+	static const uint8_t kernel17[17] = { 9, 15, 24, 34, 46, 59, 70, 77, 80, 77, 70, 59, 46, 34, 24, 15, 9 };
+
+	kernel.resize(size);
+	if (size == 17) {
+		std::copy_n(kernel17, size, kernel.begin());
+	} else {
+		// same shape as the 17 tap kernel, the outer taps are about 1/9 of the center
+		const double sigma = size / 4.4;
+		for (int k = 0; k < size; k++) {
+			const double d = k - size / 2;
+			kernel[k] = std::lround(80 * std::exp(-d * d / (2 * sigma * sigma)));
+		}
+	}
+
+	a = 0;
+	for (auto w : kernel)
+		a += w;
+}
+
+/*
+ * Call func(x0, x1) for each run of tiles in tile row ty whose changed flag
+ * equals changed. Without tiles the whole row counts as changed.
+ */
+template<class Func>
+static void for_each_span(const BlurTiles* tiles, int width, int ty, bool changed, Func func)
+{
+	if (!tiles) {
+		if (changed)
+			func(0, width);
+		return;
+	}
+
+	int start = -1;
+	for (int tx = 0; tx <= tiles->columns; tx++) {
+		if (tx < tiles->columns && tiles->changed[ty * tiles->columns + tx] == changed) {
+			if (start < 0)
+				start = tx;
+		} else if (start >= 0) {
+			func(start * BlurTiles::SIZE, std::min(tx * BlurTiles::SIZE, width));
+			start = -1;
+		}
+	}
+}
+
+static void gaussian_blur(int size, int threads, const BlurTiles* tiles,
+						  uint8_t* data, int width, int height, int stride)
+{
+	const int half = size / 2;
+	std::vector<uint32_t> kernel;
+	uint32_t a;
+	gaussian_kernel(size, kernel, a);
+
+	auto horizontal = [&](Band& band, int row)
+	{
+		int x, y, z, w;
+		uint32_t *s, *d, p;
+		int j, k;
+
+		s = (row < band.last) ? (uint32_t *) (data + row * stride) :
+			band.tail.data() + (row - band.last) * width;
+		d = band.ring.data() + (row % size) * width;
+
+		// flat tiles come out of the pass unchanged
+		for_each_span(tiles, width, row / BlurTiles::SIZE, false, [&](int x0, int x1) {
+			std::copy(s + x0, s + x1, d + x0);
+		});
+
+		for_each_span(tiles, width, row / BlurTiles::SIZE, true, [&](int x0, int x1) {
+			for (j = x0; j < x1; j++) {
+				x = y = z = w = 0;
+				for (k = 0; k < size; k++) {
+					if ((j - half + k < 0) || (j - half + k >= width))
+						continue;
+
+					p = s[j - half + k];
+
+					x += ((p >> 24) & 0xff) * kernel[k];
+					y += ((p >> 16) & 0xff) * kernel[k];
+					z += ((p >>  8) & 0xff) * kernel[k];
+					w += ((p >>  0) & 0xff) * kernel[k];
+				}
+				d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
+			}
+		});
+	};
+
+	auto prepare = [&](Band& band)
+	{
+		// rows above the band
+		for (int row = std::max(band.first - half, 0); row < band.first; row++)
+			horizontal(band, row);
+	};
+
+	auto run = [&](Band& band)
+	{
+		int x, y, z, w;
+		uint32_t *d, p;
+		int i, j, k;
+		std::vector<const uint32_t*> rows(size);
+
+		// prime the ring with the rows below the first output row
+		for (i = band.first; i < band.first + half && i < height; i++)
+			horizontal(band, i);
+
+		for (i = band.first; i < band.last; i++) {
+			// the slot for the new bottom row held row i - half - 1, no longer needed
+			if (i + half < height)
+				horizontal(band, i + half);
+
+			for (k = 0; k < size; k++) {
+				int row = i - half + k;
+				rows[k] = (row < 0 || row >= height) ? nullptr : band.ring.data() + (row % size) * width;
+			}
+
+			/* Vertically blur from the ring back into row i, flat tiles are already right */
+			d = (uint32_t *) (data + i * stride);
+			for_each_span(tiles, width, i / BlurTiles::SIZE, true, [&](int x0, int x1) {
+				for (j = x0; j < x1; j++) {
+					x = y = z = w = 0;
+					for (k = 0; k < size; k++) {
+						if (!rows[k])
+							continue;
+
+						p = rows[k][j];
+
+						x += ((p >> 24) & 0xff) * kernel[k];
+						y += ((p >> 16) & 0xff) * kernel[k];
+						z += ((p >>  8) & 0xff) * kernel[k];
+						w += ((p >>  0) & 0xff) * kernel[k];
+					}
+					d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
+				}
+			});
+		}
+	};
+
+	for_each_band(threads, width, height, stride, size, data, prepare, run);
+}
+
+static void box_blur(int size, int iterations, int threads, const BlurTiles* tiles,
+					 uint8_t* data, int width, int height, int stride)
+{
+	const int half = size / 2;
+
+	auto horizontal = [&](Band& band, int row)
+	{
+		int tx, ty, tz, tw;
+		uint32_t *s, *d, p;
+		int j;
+
+		s = (row < band.last) ? (uint32_t *) (data + row * stride) :
+			band.tail.data() + (row - band.last) * width;
+		d = band.ring.data() + (row % size) * width;
+
+		// flat tiles come out of the pass unchanged
+		for_each_span(tiles, width, row / BlurTiles::SIZE, false, [&](int x0, int x1) {
+			std::copy(s + x0, s + x1, d + x0);
+		});
+
+		for_each_span(tiles, width, row / BlurTiles::SIZE, true, [&](int x0, int x1) {
+			// preset accumulators with s(x0-half)..s(x0+half), pixels off screen are zero
+			tx = ty = tz = tw = 0;
+			for (j = std::max(x0 - half, 0); j <= x0 + half && j < width; j++) {
+				p = s[j];
+				tx += (p >> 24) & 0xff;
+				ty += (p >> 16) & 0xff;
+				tz += (p >>  8) & 0xff;
+				tw += (p >>  0) & 0xff;
+			}
+
+			for (j = x0; j < x1; j++) {
+				d[j] = (tx / size << 24) | (ty / size << 16) | (tz / size << 8) | tw / size;
+
+				// slide the window, subtract s(n-half) and add s(n+half+1)
+				if (j - half >= 0) {
+					p = s[j - half];
+					tx -= (p >> 24) & 0xff;
+					ty -= (p >> 16) & 0xff;
+					tz -= (p >>  8) & 0xff;
+					tw -= (p >>  0) & 0xff;
+				}
+				if (j + half + 1 < width) {
+					p = s[j + half + 1];
+					tx += (p >> 24) & 0xff;
+					ty += (p >> 16) & 0xff;
+					tz += (p >>  8) & 0xff;
+					tw += (p >>  0) & 0xff;
+				}
+			}
+		});
+	};
+
+	auto prepare = [&](Band& band)
+	{
+		// rows above the band
+		for (int row = std::max(band.first - half, 0); row < band.first; row++)
+			horizontal(band, row);
+	};
+
+	auto run = [&](Band& band)
+	{
+		uint32_t *s, *d, p;
+		int i, j;
+
+		// running vertical sums for every column, one entry per channel
+		std::vector<int> acc(4 * width);
+
+		// add (sign = 1) or remove (sign = -1) part of a ring row from the column sums
+		auto accumulate = [&](int row, int sign, int x0, int x1)
+		{
+			s = band.ring.data() + (row % size) * width;
+			for (j = x0; j < x1; j++) {
+				p = s[j];
+				acc[4 * j + 0] += sign * ((p >> 24) & 0xff);
+				acc[4 * j + 1] += sign * ((p >> 16) & 0xff);
+				acc[4 * j + 2] += sign * ((p >>  8) & 0xff);
+				acc[4 * j + 3] += sign * ((p >>  0) & 0xff);
+			}
+		};
+
+		// the ring holds rows first-half..first+half, rows off screen are zero
+		for (i = band.first; i <= band.first + half && i < height; i++)
+			horizontal(band, i);
+
+		for (i = band.first; i < band.last; i++) {
+			const int tile_row = i / BlurTiles::SIZE;
+
+			// column sums are only kept for changed tiles, so they are
+			// rebuilt from the ring whenever a new row of tiles starts
+			if (i == band.first || (tiles && i % BlurTiles::SIZE == 0)) {
+				for_each_span(tiles, width, tile_row, true, [&](int x0, int x1) {
+					std::fill(acc.begin() + 4 * x0, acc.begin() + 4 * x1, 0);
+					for (int row = std::max(i - half, 0); row <= i + half && row < height; row++)
+						accumulate(row, 1, x0, x1);
+				});
+			}
+
+			d = (uint32_t *) (data + i * stride);
+			for_each_span(tiles, width, tile_row, true, [&](int x0, int x1) {
+				for (j = x0; j < x1; j++) {
+					d[j] = (acc[4 * j + 0] / size << 24) |
+					       (acc[4 * j + 1] / size << 16) |
+					       (acc[4 * j + 2] / size << 8) |
+					       acc[4 * j + 3] / size;
+				}
+			});
+
+			// slide the window, the oldest row must leave the sums before its slot is reused
+			const bool slide = !tiles || (i + 1) % BlurTiles::SIZE != 0;
+			if (slide && i - half >= 0) {
+				for_each_span(tiles, width, tile_row, true, [&](int x0, int x1) {
+					accumulate(i - half, -1, x0, x1);
+				});
+			}
+			// the last row of a band needs nothing further, its tail is only half rows
+			if (i + 1 < band.last && i + half + 1 < height) {
+				horizontal(band, i + half + 1);
+				if (slide) {
+					for_each_span(tiles, width, tile_row, true, [&](int x0, int x1) {
+						accumulate(i + half + 1, 1, x0, x1);
+					});
+				}
+			}
+		}
+	};
+
+	for (int iteration = 0; iteration < iterations; iteration++)
+		for_each_band(threads, width, height, stride, size, data, prepare, run);
+}
+
+BlurTiles blur_tiles(const uint8_t* data, int width, int height, int stride, int radius)
+{
+	const int size = BlurTiles::SIZE;
+	const int reach = (radius + size - 1) / size;
+
+	BlurTiles tiles;
+	tiles.columns = (width + size - 1) / size;
+	tiles.rows = (height + size - 1) / size;
+	tiles.changed.resize(tiles.columns * tiles.rows);
+
+	std::vector<uint32_t> color(tiles.columns * tiles.rows);
+	std::vector<bool> uniform(tiles.columns * tiles.rows);
+
+	for (int ty = 0; ty < tiles.rows; ty++) {
+		for (int tx = 0; tx < tiles.columns; tx++) {
+			const int x1 = std::min(tx * size + size, width);
+			const int y1 = std::min(ty * size + size, height);
+			const uint32_t c = *(const uint32_t *) (data + ty * size * stride + tx * size * 4);
+			bool flat = true;
+
+			for (int y = ty * size; y < y1 && flat; y++) {
+				auto s = (const uint32_t *) (data + y * stride);
+				for (int x = tx * size; x < x1; x++) {
+					if (s[x] != c) {
+						flat = false;
+						break;
+					}
+				}
+			}
+
+			color[ty * tiles.columns + tx] = c;
+			uniform[ty * tiles.columns + tx] = flat;
+		}
+	}
+
+	auto unchanged = [&](int tx, int ty)
+	{
+		if (tx * size - radius < 0 || std::min(tx * size + size, width) + radius > width ||
+			ty * size - radius < 0 || std::min(ty * size + size, height) + radius > height)
+			return false;
+
+		const uint32_t c = color[ty * tiles.columns + tx];
+		for (int ny = std::max(ty - reach, 0); ny <= std::min(ty + reach, tiles.rows - 1); ny++)
+			for (int nx = std::max(tx - reach, 0); nx <= std::min(tx + reach, tiles.columns - 1); nx++)
+				if (!uniform[ny * tiles.columns + nx] || color[ny * tiles.columns + nx] != c)
+					return false;
+
+		return true;
+	};
+
+	for (int ty = 0; ty < tiles.rows; ty++)
+		for (int tx = 0; tx < tiles.columns; tx++)
+			tiles.changed[ty * tiles.columns + tx] = !unchanged(tx, ty);
+
+	return tiles;
+}
+
+void blur(const BlurConfig& config, uint8_t* data, int width, int height, int stride,
+		  const BlurTiles* tiles)
+{
+	if (width <= 0 || height <= 0 || config.kernel < 1)
+		return;
+
+	// even widths are rounded up, the kernels are centered
+	const int size = config.kernel | 1;
+
+	if (config.algorithm == BlurAlgorithm::gaussian)
+		gaussian_blur(size, config.threads, tiles, data, width, height, stride);
+	else
+		box_blur(size, config.iterations, config.threads, tiles, data, width, height, stride);
+}
+
+template<>
+const std::pair<BlurAlgorithm, char const*> detail::EnumStrings<BlurAlgorithm>::data[] =
+{
+	{BlurAlgorithm::gaussian, "gaussian"},
+	{BlurAlgorithm::box, "box"},
+};
+
+/*
+ * Something shaped like a screen: flat panels, some frames and a few blocks
+ * of text sized noise.
+ */
+static void test_pattern(std::vector<uint32_t>& image, int width, int height)
+{
+	uint32_t seed = 1;
+	auto random = [&seed]()
+	{
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	};
+
+	std::fill(image.begin(), image.end(), 0xfffaebd7);
+
+	for (int n = 0; n < 12; n++) {
+		const int x0 = random() % width;
+		const int y0 = random() % height;
+		const int x1 = std::min<int>(x0 + 20 + random() % (width / 3 + 1), width);
+		const int y1 = std::min<int>(y0 + 20 + random() % (height / 3 + 1), height);
+		const uint32_t color = 0xff000000 | random();
+		const bool text = n % 3 == 0;
+
+		for (int y = y0; y < y1; y++)
+			for (int x = x0; x < x1; x++)
+				if (!text || random() % 4 == 0)
+					image[y * width + x] = text ? 0xff000000 : color;
+	}
+}
+
+static double psnr(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b)
+{
+	double sum = 0;
+	for (size_t n = 0; n < a.size(); n++) {
+		for (int shift = 0; shift < 24; shift += 8) {
+			const int d = int((a[n] >> shift) & 0xff) - int((b[n] >> shift) & 0xff);
+			sum += d * d;
+		}
+	}
+
+	if (sum == 0)
+		return std::numeric_limits<double>::infinity();
+
+	return 10 * std::log10(255.0 * 255.0 * 3 * a.size() / sum);
+}
+
+static std::string tune_key(const Size& size, double min_psnr)
+{
+	std::ostringstream ss;
+	ss << size.width() << "x" << size.height() << " cpus " << std::thread::hardware_concurrency()
+	   << " psnr " << min_psnr;
+	return ss.str();
+}
+
+BlurConfig blur_autotune(const Size& size, double min_psnr, const std::string& cache)
+{
+	const auto key = tune_key(size, min_psnr);
+
+	if (!cache.empty()) {
+		std::ifstream in(cache);
+		std::string line;
+		while (std::getline(in, line)) {
+			if (line.compare(0, key.size() + 2, key + ": "))
+				continue;
+
+			std::istringstream ss(line.substr(key.size() + 2));
+			std::string algorithm;
+			BlurConfig config;
+			if (!(ss >> algorithm >> config.kernel >> config.iterations >> config.threads))
+				continue;
+
+			// a damaged line is skipped, the tuning then runs again
+			if (algorithm == detail::enum_to_string(BlurAlgorithm::gaussian))
+				config.algorithm = BlurAlgorithm::gaussian;
+			else if (algorithm == detail::enum_to_string(BlurAlgorithm::box))
+				config.algorithm = BlurAlgorithm::box;
+			else
+				continue;
+
+			if (config.kernel < 1 || config.iterations < 1 || config.threads < 0)
+				continue;
+
+			std::cout << "Blur tuning from " << cache << ": " << config << std::endl;
+			return config;
+		}
+	}
+
+	const int width = size.width();
+	const int height = size.height();
+	const int cpus = std::max<int>(std::thread::hardware_concurrency(), 1);
+
+	std::vector<uint32_t> pattern(width * height);
+	test_pattern(pattern, width, height);
+
+	BlurConfig reference;
+	reference.algorithm = BlurAlgorithm::gaussian;
+	reference.kernel = 17;
+	auto expected = pattern;
+	blur(reference, (uint8_t*) expected.data(), width, height, width * 4);
+
+	std::vector<BlurConfig> candidates;
+	for (auto threads : {1, cpus}) {
+		for (auto kernel : {17, 13, 9})
+			candidates.push_back({BlurAlgorithm::gaussian, kernel, 1, threads});
+		for (auto kernel : {3, 5, 7})
+			for (auto iterations : {2, 3})
+				candidates.push_back({BlurAlgorithm::box, kernel, iterations, threads});
+		if (cpus == 1)
+			break;
+	}
+
+	BlurConfig best = reference;
+	auto best_time = std::chrono::microseconds::max();
+	std::vector<uint32_t> image(pattern.size());
+
+	for (const auto& config : candidates) {
+		// best of three to keep scheduling noise out
+		auto time = std::chrono::microseconds::max();
+		for (int run = 0; run < 3; run++) {
+			image = pattern;
+			auto start = std::chrono::steady_clock::now();
+			blur(config, (uint8_t*) image.data(), width, height, width * 4);
+			time = std::min(time, std::chrono::duration_cast<std::chrono::microseconds>(
+								std::chrono::steady_clock::now() - start));
+		}
+
+		const double quality = psnr(image, expected);
+		std::cout << "Blur tuning " << config << ": " << time.count() << "us, "
+				  << quality << "dB" << std::endl;
+
+		if (quality >= min_psnr && time < best_time) {
+			best = config;
+			best_time = time;
+		}
+	}
+
+	std::cout << "Blur tuning picked " << best << std::endl;
+
+	if (!cache.empty()) {
+		std::ofstream out(cache, std::ios::app);
+		out << key << ": " << detail::enum_to_string(best.algorithm) << " " << best.kernel << " "
+			<< best.iterations << " " << best.threads << std::endl;
+	}
+
+	return best;
+}
+
+std::ostream& operator<<(std::ostream& os, const BlurAlgorithm& algorithm)
+{
+	return os << detail::enum_to_string(algorithm);
+}
+
+std::ostream& operator<<(std::ostream& os, const BlurConfig& config)
+{
+	os << config.algorithm << " " << config.kernel;
+	if (config.algorithm == BlurAlgorithm::box)
+		os << "x" << config.iterations;
+	return os << ", " << config.threads << (config.threads == 1 ? " thread" : " threads");
+}
+
+}
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2021 Microchip Technology Inc.  All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#ifndef EGT_BLUR_H
+#define EGT_BLUR_H
+
+/**
+ * @file
+ * @brief Separable blur filters for ARGB32 images.
+ */
+
+#include <cstdint>
+#include <egt/detail/meta.h>
+#include <egt/geometry.h>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace egt
+{
+inline namespace v1
+{
+
+/// Blur algorithm.
+enum class BlurAlgorithm : uint32_t
+{
+    /// Gaussian kernel.
+    gaussian,
+    /// Repeated box filter with running sums.
+    box,
+};
+
+/**
+ * Blur engine selection.
+ *
+ * Both filters run in place, streaming the horizontal pass through a ring of
+ * row buffers. With more than one thread the image is split into bands of
+ * rows, each blurred by its own thread.
+ */
+struct EGT_API BlurConfig
+{
+    /// Blur algorithm.
+    BlurAlgorithm algorithm{BlurAlgorithm::box};
+
+    /// Kernel width in pixels, odd. Taps for the Gaussian, width for the box.
+    int kernel{3};
+
+    /// Number of box filter passes, ignored by the Gaussian.
+    int iterations{3};
+
+    /// Number of threads, 0 uses one per CPU.
+    int threads{1};
+
+    /// Distance in pixels over which a pixel affects the output.
+    EGT_NODISCARD int radius() const
+    {
+        return algorithm == BlurAlgorithm::gaussian ? kernel / 2 : kernel / 2 * iterations;
+    }
+};
+
+/**
+ * Which tiles of an image a blur changes.
+ *
+ * A tile whose pixels, and all pixels within the blur radius of them, are a
+ * single color comes out of the blur unchanged. Tiles within the radius of
+ * the image edge always change, the filters darken there.
+ */
+struct EGT_API BlurTiles
+{
+    /// Edge length of a tile in pixels.
+    constexpr static const int SIZE = 32;
+
+    /// Number of tile columns.
+    int columns{0};
+
+    /// Number of tile rows.
+    int rows{0};
+
+    /// One flag per tile, row by row, set where the blur changes the tile.
+    std::vector<bool> changed;
+};
+
+/**
+ * Find the tiles of an ARGB32 image that a blur would change.
+ *
+ * @param[in] data First pixel of the image.
+ * @param[in] width Width of the image in pixels.
+ * @param[in] height Height of the image in pixels.
+ * @param[in] stride Distance between rows in bytes.
+ * @param[in] radius Blur radius, see BlurConfig::radius().
+ */
+EGT_API BlurTiles blur_tiles(const uint8_t* data, int width, int height, int stride, int radius);
+
+/**
+ * Blur an ARGB32 image in place.
+ *
+ * Given the tiles from blur_tiles(), the filters only run over changed
+ * tiles, so the cost follows the amount of detail rather than the size
+ * of the image.
+ *
+ * @param[in] config Blur engine to use.
+ * @param[in,out] data First pixel of the image.
+ * @param[in] width Width of the image in pixels.
+ * @param[in] height Height of the image in pixels.
+ * @param[in] stride Distance between rows in bytes.
+ * @param[in] tiles Tiles found for this image and config, nullptr to blur everything.
+ */
+EGT_API void blur(const BlurConfig& config, uint8_t* data, int width, int height, int stride,
+                  const BlurTiles* tiles = nullptr);
+
+/**
+ * Pick the fastest blur engine for a screen size on this CPU.
+ *
+ * Each candidate engine blurs a synthetic screen of the given size and is
+ * timed. Its output is compared with the 17 tap Gaussian, and candidates
+ * below the quality floor are rejected.
+ *
+ * @param[in] size Screen size.
+ * @param[in] min_psnr Quality floor, PSNR against the 17 tap Gaussian in dB.
+ * @param[in] cache File used to store the result between runs, empty for none.
+ */
+EGT_API BlurConfig blur_autotune(const Size& size, double min_psnr, const std::string& cache = {});
+
+/// Overloaded std::ostream insertion operator
+EGT_API std::ostream& operator<<(std::ostream& os, const BlurAlgorithm& algorithm);
+
+/// Overloaded std::ostream insertion operator
+EGT_API std::ostream& operator<<(std::ostream& os, const BlurConfig& config);
+
+}
+}
+
+#endif
@@ -4,339 +4,213 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <algorithm>
+#include <chrono>
 #include <egt/ui>
-#include <cairo/cairo.h>
+#include <exception>
 #include <iostream>
-#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "backdrop.h"
+#include "blur.h"
 #include "sideboard2.h"
 
-#define KERNEL_SIZE 17
-#define KERNEL_HALF_SIZE 8
+/*
+ * Blur options, taken off the command line before it is handed to egt.
+ *
+ *   --blur=gaussian|box|auto  blur algorithm, auto runs the tuner and cannot
+ *                             be combined with the next three options
+ *   --blur-kernel=N           kernel width in pixels
+ *   --blur-iterations=N       box filter passes
+ *   --blur-threads=N          threads, 0 for one per CPU
+ *   --blur-scale=N            capture at 1/N of the screen size, 1, 2 or 4
+ *   --blur-quality=DB         tuner quality floor, PSNR against the 17 tap Gaussian
+ *   --blur-cache=FILE         file the tuner keeps its result in
+ *   --blur-stream=off|planes|pattern
+ *                             keep blurring moving content while board0 is
+ *                             open, off by default, planes re-blurs the
+ *                             visible plane windows, pattern uses a
+ *                             synthetic source
+ *   --blur-fps=N              frame rate of the stream, 1 to 240
+ *   --blur-budget=MS          time allowed for a capture, the blur drops to a
+ *                             cheaper level to meet it and is refined later
+ */
+struct BlurOptions
+{
+    egt::BlurConfig config;
+    int scale{1};
+    bool tune{false};
+    double quality{30};
+    std::string cache;
+    std::string stream{"off"};
+    int fps{30};
+    double budget{0};
+};
 
-static std::shared_ptr<egt::ImageLabel> blur_background_gaussian(egt::Application& app)
+/*
+ * A whole argument as a number no lower than min, "abc" and "3x" are
+ * rejected rather than read as far as they go.
+ */
+static bool parse_number(const std::string& value, int min, int& result)
 {
-    int timediff = 0;
-    struct timeval time1, time2;
-    gettimeofday(&time1, NULL);
-
-	auto surface = egt::shared_cairo_surface_t(
-						cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-												   app.screen()->size().width(),
-												   app.screen()->size().height()),
-						cairo_surface_destroy);
-	auto cr = egt::shared_cairo_t(cairo_create(surface.get()), cairo_destroy);
-
-	// render the screen to the new surface
-	egt::Painter painter(cr);
-	for (auto& w : app.windows()) {
-		if (!w->visible())
-			continue;
-
-		// draw top level frames and plane frames
-		if (w->top_level() || w->plane_window())
-			w->paint(painter);
-	}
-
-    gettimeofday(&time2, NULL);
-    timediff = (time1.tv_sec < time2.tv_sec) ? (time2.tv_usec + 1000000 - time1.tv_usec) : (time2.tv_usec - time1.tv_usec);
-    std::cout << "Repaint screen to surface: " << timediff << "us" << std::endl;
-    gettimeofday(&time1, NULL);
-
-	// we now have a copy of the top level screen to perform the blur on
-	cairo_surface_t* tmpSurface;
-	int width, height;
-	int src_stride, dst_stride;
-	int x, y, z, w;
-	uint8_t *src, *dst;
-	uint32_t *s, *d, p;
-	int i, j, k;
-	// use a pre-computed Gaussian kernel
-	const uint32_t a = 0x2EC;
-	const uint8_t kernel[17] = { 9, 15, 24, 34, 46, 59, 70, 77, 80, 77, 70, 59, 46, 34, 24, 15, 9 };
-
-	width = app.screen()->size().width();
-	height = app.screen()->size().height();
-
-	// screen surface will be ARGB32
-    tmpSurface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
-
-    src = cairo_image_surface_get_data (surface.get());
-    src_stride = cairo_image_surface_get_stride (surface.get());
-
-    dst = cairo_image_surface_get_data (tmpSurface);
-    dst_stride = cairo_image_surface_get_stride (tmpSurface);
-
-    /* Horizontally blur from surface -> tmp */
-    for (i = 0; i < height; i++) {
-		s = (uint32_t *) (src + i * src_stride);
-		d = (uint32_t *) (dst + i * dst_stride);
-
-		for (j = 0; j < width; j++) {
-			x = y = z = w = 0;
-			for (k = 0; k < KERNEL_SIZE; k++) {
-				if ((j - KERNEL_HALF_SIZE + k < 0) || (j - KERNEL_HALF_SIZE + k >= width))
-					continue;
-
-				p = s[j - KERNEL_HALF_SIZE + k];
-
-				x += ((p >> 24) & 0xff) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >>  8) & 0xff) * kernel[k];
-				w += ((p >>  0) & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
-		}
+    try
+    {
+        size_t end = 0;
+        const int number = std::stoi(value, &end);
+        if (end != value.size() || number < min)
+            return false;
+        result = number;
+        return true;
+    }
+    catch (const std::exception&)
+    {
+        return false;
     }
+}
 
-    /* Then vertically blur from tmp -> surface */
-    for (i = 0; i < height; i++) {
-		s = (uint32_t *) (dst + i * dst_stride);
-		d = (uint32_t *) (src + i * src_stride);
-
-		for (j = 0; j < width; j++) {
-			x = y = z = w = 0;
-			for (k = 0; k < KERNEL_SIZE; k++) {
-				if ((i - KERNEL_HALF_SIZE + k < 0) || (i - KERNEL_HALF_SIZE + k >= height))
-					continue;
-
-				s = (uint32_t *) (dst + (i - KERNEL_HALF_SIZE + k) * dst_stride);
-				p = s[j];
-
-				x += ((p >> 24) & 0xff) * kernel[k];
-				y += ((p >> 16) & 0xff) * kernel[k];
-				z += ((p >>  8) & 0xff) * kernel[k];
-				w += ((p >>  0) & 0xff) * kernel[k];
-			}
-			d[j] = (x / a << 24) | (y / a << 16) | (z / a << 8) | w / a;
-		}
+static bool parse_number(const std::string& value, double min, double& result)
+{
+    try
+    {
+        size_t end = 0;
+        const double number = std::stod(value, &end);
+        if (end != value.size() || number < min)
+            return false;
+        result = number;
+        return true;
     }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
 
-    // destroy the temporary surface and tell Cairo we changed the image
-    cairo_surface_destroy (tmpSurface);
-    cairo_surface_mark_dirty (surface.get());
+/*
+ * Take the blur options off the command line. A bad value is reported and
+ * false returned.
+ */
+static bool parse_blur_options(int& argc, char** argv, BlurOptions& options)
+{
+    int kernel = 0;
+    bool engine = false;
+    int out = 1;
 
-    gettimeofday(&time2, NULL);
-    timediff = (time1.tv_sec < time2.tv_sec) ? (time2.tv_usec + 1000000 - time1.tv_usec) : (time2.tv_usec - time1.tv_usec);
-    std::cout << "Gaussian blur: " << timediff << "us" << std::endl;
+    for (int n = 1; n < argc; n++)
+    {
+        const std::string arg = argv[n];
+        std::string value;
+
+        auto option = [&arg, &value](const std::string & name)
+        {
+            if (arg.compare(0, name.size(), name))
+                return false;
+            value = arg.substr(name.size());
+            return true;
+        };
+
+        bool valid = true;
+
+        if (option("--blur="))
+        {
+            if (value == "auto")
+                options.tune = true;
+            else if (value == "gaussian")
+                options.config.algorithm = egt::BlurAlgorithm::gaussian;
+            else if (value == "box")
+                options.config.algorithm = egt::BlurAlgorithm::box;
+            else
+                valid = false;
+        }
+        else if (option("--blur-kernel="))
+            valid = engine = parse_number(value, 1, kernel);
+        else if (option("--blur-iterations="))
+            valid = engine = parse_number(value, 1, options.config.iterations);
+        else if (option("--blur-threads="))
+            valid = engine = parse_number(value, 0, options.config.threads);
+        else if (option("--blur-scale="))
+            valid = parse_number(value, 1, options.scale) &&
+                    (options.scale == 1 || options.scale == 2 || options.scale == 4);
+        else if (option("--blur-quality="))
+            valid = parse_number(value, 0.0, options.quality);
+        else if (option("--blur-cache="))
+            options.cache = value;
+        else if (option("--blur-stream="))
+        {
+            options.stream = value;
+            valid = value == "off" || value == "planes" || value == "pattern";
+        }
+        else if (option("--blur-fps="))
+            valid = parse_number(value, 1, options.fps) && options.fps <= 240;
+        else if (option("--blur-budget="))
+            valid = parse_number(value, 0.0, options.budget);
+        else
+            argv[out++] = argv[n];
+
+        if (!valid)
+        {
+            std::cerr << argv[0] << ": invalid option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    argc = out;
+    argv[argc] = nullptr;
 
-	// create an ImageLabel object
-	egt::Image image(surface);
-	auto imageLabel = std::make_shared<egt::ImageLabel>(image);
-	return imageLabel;
+    // the tuner replaces the whole engine, explicit values would be lost
+    if (options.tune && engine)
+    {
+        std::cerr << argv[0] << ": --blur=auto picks the kernel, iterations and threads "
+                  << "itself and cannot be combined with them" << std::endl;
+        return false;
+    }
+
+    if (kernel)
+        options.config.kernel = kernel;
+    else if (options.config.algorithm == egt::BlurAlgorithm::gaussian)
+        options.config.kernel = 17;
+
+    return true;
 }
 
-static std::shared_ptr<egt::ImageLabel> blur_background_box(egt::Application& app)
+/*
+ * Moving content to keep blurred while board0 is open, if any. Streaming
+ * is opt in: on a target the sideboards may be plane windows themselves,
+ * and re-blurring them would cost a blur per frame for nothing.
+ */
+static std::shared_ptr<egt::Backdrop::Source> stream_source(egt::Application& app, const BlurOptions& options)
 {
-    int timediff = 0;
-    struct timeval time1, time2;
-    gettimeofday(&time1, NULL);
-
-	auto surface = egt::shared_cairo_surface_t(
-						cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
-												   app.screen()->size().width(),
-												   app.screen()->size().height()),
-						cairo_surface_destroy);
-	auto cr = egt::shared_cairo_t(cairo_create(surface.get()), cairo_destroy);
-
-	// render the screen to the new surface
-	egt::Painter painter(cr);
-	for (auto& w : app.windows()) {
-		if (!w->visible())
-			continue;
-
-		// draw top level frames and plane frames
-		if (w->top_level() || w->plane_window())
-			w->paint(painter);
-	}
-
-    gettimeofday(&time2, NULL);
-    timediff = (time1.tv_sec < time2.tv_sec) ? (time2.tv_usec + 1000000 - time1.tv_usec) : (time2.tv_usec - time1.tv_usec);
-    std::cout << "Repaint screen to surface: " << timediff << "us" << std::endl;
-    gettimeofday(&time1, NULL);
-
-    // perform a box blur
-    const int MAX_ITERATIONS = 3;
-    int iteration;
-	int width, height;
-	uint8_t *src, *dst;
-	int src_stride, dst_stride;
-	int i, j;
-	uint32_t *d, p;
-
-	width = app.screen()->size().width();
-	height = app.screen()->size().height();
-
-	// we now have a copy of the top level screen to perform the blur on
-	cairo_surface_t* tmpSurface;
-	tmpSurface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
-
-    src = cairo_image_surface_get_data (surface.get());
-    src_stride = cairo_image_surface_get_stride (surface.get());
-    dst = cairo_image_surface_get_data (tmpSurface);
-    dst_stride = cairo_image_surface_get_stride (tmpSurface);
-
-    // the ARGB components, order does not matter
-    int tx, ty, tz, tw;
-    uint32_t *s0, *s1, *s2; // these are the 3 pointers for the sliding window
-
-    for(iteration = 0; iteration < MAX_ITERATIONS; iteration++) {
-    	// horizontally blur from src->tmp
-    	for(i = 0; i < height; i++) {
-    		d = (uint32_t*) (dst + i * dst_stride);
-
-    		// s0 is off screen
-    		s1 = (uint32_t*) (src + i * src_stride);
-    		s2 = s1 + 1;
-
-    		// calculate d(0) = s(n-1) + s(n) + s(n+1)
-    		// s(n-1) = 0 for first entry
-    		// preset accumulators and set d(0)
-    		p = *s1;
-			tx = (p >> 24) & 0xff;
-			ty = (p >> 16) & 0xff;
-			tz = (p >>  8) & 0xff;
-			tw = (p >>  0) & 0xff;
-
-			p = *s2;
-			tx += (p >> 24) & 0xff;
-			ty += (p >> 16) & 0xff;
-			tz += (p >>  8) & 0xff;
-			tw += (p >>  0) & 0xff;
-			*d++ = (tx / 3 << 24) | (ty / 3 << 16) | (tz / 3 << 8) | tw / 3;
-
-			// increment pointers and set first s(n-1)
-			s0 = (uint32_t*) (src + i * src_stride);
-			s2++;
-
-			// calculate d(1)
-			// subtract s(n-1) not required as it is zero
-			p = *s2;
-			tx += (p >> 24) & 0xff;
-			ty += (p >> 16) & 0xff;
-			tz += (p >>  8) & 0xff;
-			tw += (p >>  0) & 0xff;
-			*d++ = (tx / 3 << 24) | (ty / 3 << 16) | (tz / 3 << 8) | tw / 3;
-
-    		for(j = 2; j < (width - 1); j++) {
-    			// subtract value for s(n-1)
-    			p = *s0;
-				tx -= (p >> 24) & 0xff;
-				ty -= (p >> 16) & 0xff;
-				tz -= (p >>  8) & 0xff;
-				tw -= (p >>  0) & 0xff;
-
-    			// update pointers
-    			s0++;
-    			s2++;
-
-    			// add the channel values for s(n+1)
-    			p = *s2;
-				tx += (p >> 24) & 0xff;
-				ty += (p >> 16) & 0xff;
-				tz += (p >>  8) & 0xff;
-				tw += (p >>  0) & 0xff;
-
-    			*d++ = (tx / 3 << 24) | (ty / 3 << 16) | (tz / 3 << 8) | tw / 3;
-    		}
-
-    		// calculate last pixel in row
-    		p = *s0;
-			tx -= (p >> 24) & 0xff;
-			ty -= (p >> 16) & 0xff;
-			tz -= (p >>  8) & 0xff;
-			tw -= (p >>  0) & 0xff;
-			*d = (tx / 3 << 24) | (ty / 3 << 16) | (tz / 3 << 8) | tw / 3;
-    	}
-
-    	// vertically blur from tmp->src
-    	for(j = 0; j < width; j++) {
-    		// preset accumulators and set d(0) and d(1)
-    		s1 = (uint32_t*) (dst); // remember we are copying back from the temporary buffer
-    		s1 += j; // adjust pointer according to current width position
-    		s2 = s1 + (dst_stride / 4);
-    		s0 = s1; // used later, just pre-init for now
-
-    		// do not add in s(n-1) as it is off-screen
-			p = *s1;
-			tx = (p >> 24) & 0xff;
-			ty = (p >> 16) & 0xff;
-			tz = (p >>  8) & 0xff;
-			tw = (p >>  0) & 0xff;
-
-			p = *s2;
-			tx += (p >> 24) & 0xff;
-			ty += (p >> 16) & 0xff;
-			tz += (p >>  8) & 0xff;
-			tw += (p >>  0) & 0xff;
-
-			d = (uint32_t*) (src); // copying back into original surface
-			d += j; // adjust for horizontal position
-			*d = (tx / 3 << 24) | (ty / 3 << 16) | (tz / 3 << 8) | tw / 3;
-
-			// increment pointers
-			// subtract s(n-1) not required as it was zero
-			s2 += dst_stride / 4; // advance by screen width, allowing for pixel density
-			p = *s2;
-			tx += (p >> 24) & 0xff;
-			ty += (p >> 16) & 0xff;
-			tz += (p >>  8) & 0xff;
-			tw += (p >>  0) & 0xff;
-			d += src_stride / 4;
-			*d = (tx / 3 << 24) | (ty / 3 << 16) | (tz / 3 << 8) | tw / 3;
-
-    		for(i = 2; i < (height - 1); i++) {
-    			// subtract value for s(n-2)
-    			p = *s0;
-				tx -= (p >> 24) & 0xff;
-				ty -= (p >> 16) & 0xff;
-				tz -= (p >>  8) & 0xff;
-				tw -= (p >>  0) & 0xff;
-
-				// update pointers
-				s0 += dst_stride / 4;
-				s2 += dst_stride / 4;
-
-    			// add the channel values for s(n+1)
-    			p = *s2;
-				tx += (p >> 24) & 0xff;
-				ty += (p >> 16) & 0xff;
-				tz += (p >>  8) & 0xff;
-				tw += (p >>  0) & 0xff;
-
-				d += src_stride / 4;
-    			*d = (tx / 3 << 24) | (ty / 3 << 16) | (tz / 3 << 8) | tw / 3;
-    		}
-
-    		// calculate last pixel in column
-			p = *s0;
-			tx -= (p >> 24) & 0xff;
-			ty -= (p >> 16) & 0xff;
-			tz -= (p >>  8) & 0xff;
-			tw -= (p >>  0) & 0xff;
-			d += src_stride / 4;
-			*d = (tx / 3 << 24) | (ty / 3 << 16) | (tz / 3 << 8) | tw / 3;
-    	}
+    if (options.stream == "pattern")
+    {
+        const auto size = app.screen()->size();
+        return std::make_shared<egt::Backdrop::PatternSource>(
+                   egt::Rect(size.width() / 4, size.height() / 4, size.width() / 2, size.height() / 2));
     }
 
-    // destroy the temporary surface and tell Cairo we changed the image
-    cairo_surface_destroy (tmpSurface);
-    cairo_surface_mark_dirty (surface.get());
-
-    gettimeofday(&time2, NULL);
-    timediff = (time1.tv_sec < time2.tv_sec) ? (time2.tv_usec + 1000000 - time1.tv_usec) : (time2.tv_usec - time1.tv_usec);
-    std::cout << "Box blur: " << timediff << "us" << std::endl;
+    if (options.stream == "planes")
+    {
+        for (auto& w : app.windows())
+        {
+            if (w->visible() && w->plane_window())
+                return std::make_shared<egt::Backdrop::PlaneSource>(app);
+        }
+    }
 
-	// create an ImageLabel object
-	egt::Image image(surface);
-	auto imageLabel = std::make_shared<egt::ImageLabel>(image);
-	return imageLabel;
+    return nullptr;
 }
 
 int main(int argc, char** argv)
 {
+    BlurOptions options;
+    if (!parse_blur_options(argc, argv, options))
+        return 1;
+
     egt::Application app(argc, argv);
 
-    egt::TopWindow win;
+    if (options.tune)
+        options.config = egt::blur_autotune(app.screen()->size(), options.quality, options.cache);
+
+    // draws only the backdrop where it covers the screen
+    egt::BackdropWindow win;
 
     auto create_label = [](const std::string & text)
     {
@@ -363,6 +237,26 @@ int main(int argc, char** argv)
     auto mainButton = std::make_shared<egt::Button>(win, "Main Button", egt::Rect(360, 360, 80, 40));
     mainButton->align(egt::AlignFlag::center_horizontal);
 
+    // blurred copy of the screen shown while board0 is open
+    auto backdrop = std::make_shared<egt::Backdrop>(options.config);
+    backdrop->scale(options.scale);
+    backdrop->budget(std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::duration<double, std::milli>(options.budget)));
+    backdrop->hide();
+    win.add(backdrop);
+
+    // anything that changes what is under the backdrop has to invalidate it
+    auto main_text = [mainLabel, backdrop](const std::string & text)
+    {
+        if (mainLabel->text() != text)
+        {
+            mainLabel->text(text);
+            backdrop->invalidate();
+        }
+    };
+
+    // the other boards, a board still sliding makes the backdrop stale
+    std::vector<egt::SideBoard2*> boards;
 
     egt::SideBoard2 board0(egt::SideBoard2::PositionFlag::left, egt::Size(140, 0),
                           egt::WindowHint::software);
@@ -371,26 +265,35 @@ int main(int argc, char** argv)
     win.add(board0);
     board0.show();
 
-    board0.on_event([&app, &mainLabel, &board0, &win] (egt::Event& event) {
-    	static std::shared_ptr<egt::ImageLabel> blurredImage = nullptr;
-
+    // the label reads "Open" at every capture, so a reopen repaints to the
+    // same pixels and the backdrop is reused without blurring
+    board0.on_event([&app, &options, &main_text, &board0, &boards, backdrop] (egt::Event& event) {
     	switch (event.id())
     	{
     		case egt::EventId::pointer_click:
-    	    	mainLabel->text("board0: " + egt::detail::to_string(event.pointer().point));
-
     	    	if (!board0.is_open()) {
     	    		// sideboard is opening
-    	    		mainLabel->text("Open");
-    	    		blurredImage = blur_background_box(app);
-//    	    		blurredImage = blur_background_gaussian(app);
-    	    		win.add(blurredImage);
+    	    		main_text("board0: " + egt::detail::to_string(event.pointer().point));
+    	    		main_text("Open");
+    	    		const bool moving = std::any_of(boards.begin(), boards.end(),
+    	    		                                [](egt::SideBoard2* board) { return board->is_moving(); });
+    	    		backdrop->capture(app);
+    	    		// a board caught mid-slide is not where it will stay, so
+    	    		// this capture must not be reused
+    	    		if (moving)
+    	    			backdrop->invalidate();
+    	    		if (auto source = stream_source(app, options))
+    	    			backdrop->stream(app, source, std::chrono::milliseconds(1000 / options.fps));
+    	    		backdrop->zorder_top();
     	    		board0.zorder_top();
+    	    		// shown last so it knows which widgets end up underneath it
+    	    		backdrop->show();
     	    	} else {
-    	    		// sideboard is closing
-    	    		win.remove(blurredImage.get());
-    	    		mainLabel->text("Close");
-    	    		win.damage();
+    	    		// sideboard is closing, the label changes once the backdrop
+    	    		// is gone, so it is drawn directly rather than held back
+    	    		backdrop->hide();
+    	    		main_text("board0: " + egt::detail::to_string(event.pointer().point));
+    	    		main_text("Close");
     	    	}
 
     			break;
@@ -402,11 +305,11 @@ int main(int argc, char** argv)
     // add a button to the sideboard
     egt::Button buttonLeft(board0, "Button1", egt::Rect(20, 100, 80, 40));
 
-    win.on_event([mainLabel] (egt::Event& event) {
+    win.on_event([main_text] (egt::Event& event) {
     	switch (event.id())
     	{
     		case egt::EventId::pointer_click:
-    			mainLabel->text("win: " + egt::detail::to_string(event.pointer().point));
+    			main_text("win: " + egt::detail::to_string(event.pointer().point));
     			break;
     		default:
     			break;
@@ -431,6 +334,21 @@ int main(int argc, char** argv)
     win.add(board3);
     board3.show();
 
+    for (auto board : {&board1, &board2, &board3})
+    {
+        board->on_event([backdrop] (egt::Event& event) {
+        	switch (event.id())
+        	{
+        		case egt::EventId::pointer_click:
+        			backdrop->invalidate();
+        			break;
+        		default:
+        			break;
+        	}
+        });
+        boards.push_back(board);
+    }
+
     win.show();
 
     return app.run();
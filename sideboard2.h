@@ -103,6 +103,9 @@ public:
     // report opened state
     bool is_open() { return m_dir; }
 
+    // report whether the board is still sliding
+    bool is_moving() { return m_oanim.running() || m_canim.running(); }
+
     void serialize(Serializer& serializer) const override;
 
 protected: